@@ -1,216 +1,2932 @@
 #include <iostream>
 #include <vector>
+#include <numeric>
+#include <algorithm>
+#include <new>
+#include <array>
+#include <utility>
+#include <limits>
+#include <cstdint>
+#include <type_traits>
 #include <mutex>
 #include <condition_variable>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <map>
+#include <list>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <tuple>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BANKER_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-class BankersAlgorithm
-{
-private:
-    vector<vector<int>> allocation;
-    vector<vector<int>> max;
-    vector<int> available;
-    vector<int> resources;
-    vector<bool> completed;
-    mutex mtx;
-    condition_variable cv;
+// Allocator handing out storage aligned to a cache line
+template <typename T>
+struct AlignedAllocator
+{
+    using value_type = T;
+    static constexpr size_t alignment = 64;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(::operator new(n * sizeof(T), align_val_t(alignment)));
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        ::operator delete(p, align_val_t(alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U> &) const { return false; }
+};
+
+// Dense row-major matrix in one contiguous block. Every row starts on a 64-byte
+// boundary and is zero padded up to the stride, so whole rows can be processed
+// in vector-register sized chunks and a copy of the matrix is a single memcpy.
+template <typename T>
+class Matrix
+{
+private:
+    size_t numRows = 0;
+    size_t numCols = 0;
+    size_t rowStride = 0;
+    vector<T, AlignedAllocator<T>> cells;
+
+public:
+    static size_t strideFor(size_t cols)
+    {
+        size_t perLine = AlignedAllocator<T>::alignment / sizeof(T);
+        return (cols + perLine - 1) / perLine * perLine;
+    }
+
+    Matrix() = default;
+
+    Matrix(size_t rows, size_t cols) : numRows(rows), numCols(cols), rowStride(strideFor(cols)), cells(rows * rowStride, T()) {}
+
+    explicit Matrix(const vector<vector<T>> &values) : Matrix(values.size(), values.empty() ? 0 : values[0].size())
+    {
+        for (size_t i = 0; i < numRows; ++i)
+        {
+            copy(values[i].begin(), values[i].end(), (*this)[i]);
+        }
+    }
+
+    size_t rows() const { return numRows; }
+    size_t cols() const { return numCols; }
+    size_t stride() const { return rowStride; }
+
+    T *operator[](size_t i) { return cells.data() + i * rowStride; }
+    const T *operator[](size_t i) const { return cells.data() + i * rowStride; }
+};
+
+// Whole-row kernels for the safety check over counters of type T. Rows are
+// Matrix rows (or buffers of the same stride), so their length is a whole
+// number of 64-byte lines and the padding is zero.
+template <typename T>
+struct RowKernels
+{
+    // True when need[k] <= work[k] for every k
+    bool (*fits)(const T *need, const T *work, size_t length);
+    // work[k] += allocation[k] for every k
+    void (*add)(T *work, const T *allocation, size_t length);
+};
+
+template <typename T>
+static bool fitsScalar(const T *need, const T *work, size_t length)
+{
+    for (size_t k = 0; k < length; ++k)
+    {
+        if (need[k] > work[k])
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+static void addScalar(T *work, const T *allocation, size_t length)
+{
+    for (size_t k = 0; k < length; ++k)
+        work[k] += allocation[k];
+}
+
+#ifdef BANKER_X86_DISPATCH
+// Lane-wise need > work and work + allocation for each supported counter width.
+// SSE and AVX2 only compare signed lanes, so unsigned lanes get their sign bit
+// flipped first, which maps unsigned order onto signed order.
+template <typename T>
+__m128i overSse42(__m128i need, __m128i work);
+template <typename T>
+__m128i addSse42(__m128i work, __m128i allocation);
+
+template <>
+__attribute__((target("sse4.2"))) inline __m128i overSse42<int32_t>(__m128i need, __m128i work) { return _mm_cmpgt_epi32(need, work); }
+template <>
+__attribute__((target("sse4.2"))) inline __m128i overSse42<int64_t>(__m128i need, __m128i work) { return _mm_cmpgt_epi64(need, work); }
+template <>
+__attribute__((target("sse4.2"))) inline __m128i overSse42<uint32_t>(__m128i need, __m128i work)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    return _mm_cmpgt_epi32(_mm_xor_si128(need, bias), _mm_xor_si128(work, bias));
+}
+template <>
+__attribute__((target("sse4.2"))) inline __m128i overSse42<uint16_t>(__m128i need, __m128i work)
+{
+    const __m128i bias = _mm_set1_epi16(INT16_MIN);
+    return _mm_cmpgt_epi16(_mm_xor_si128(need, bias), _mm_xor_si128(work, bias));
+}
+
+template <>
+__attribute__((target("sse4.2"))) inline __m128i addSse42<int32_t>(__m128i work, __m128i allocation) { return _mm_add_epi32(work, allocation); }
+template <>
+__attribute__((target("sse4.2"))) inline __m128i addSse42<uint32_t>(__m128i work, __m128i allocation) { return _mm_add_epi32(work, allocation); }
+template <>
+__attribute__((target("sse4.2"))) inline __m128i addSse42<int64_t>(__m128i work, __m128i allocation) { return _mm_add_epi64(work, allocation); }
+template <>
+__attribute__((target("sse4.2"))) inline __m128i addSse42<uint16_t>(__m128i work, __m128i allocation) { return _mm_add_epi16(work, allocation); }
+
+template <typename T>
+__m256i overAvx2(__m256i need, __m256i work);
+template <typename T>
+__m256i addAvx2(__m256i work, __m256i allocation);
+
+template <>
+__attribute__((target("avx2"))) inline __m256i overAvx2<int32_t>(__m256i need, __m256i work) { return _mm256_cmpgt_epi32(need, work); }
+template <>
+__attribute__((target("avx2"))) inline __m256i overAvx2<int64_t>(__m256i need, __m256i work) { return _mm256_cmpgt_epi64(need, work); }
+template <>
+__attribute__((target("avx2"))) inline __m256i overAvx2<uint32_t>(__m256i need, __m256i work)
+{
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    return _mm256_cmpgt_epi32(_mm256_xor_si256(need, bias), _mm256_xor_si256(work, bias));
+}
+template <>
+__attribute__((target("avx2"))) inline __m256i overAvx2<uint16_t>(__m256i need, __m256i work)
+{
+    const __m256i bias = _mm256_set1_epi16(INT16_MIN);
+    return _mm256_cmpgt_epi16(_mm256_xor_si256(need, bias), _mm256_xor_si256(work, bias));
+}
+
+template <>
+__attribute__((target("avx2"))) inline __m256i addAvx2<int32_t>(__m256i work, __m256i allocation) { return _mm256_add_epi32(work, allocation); }
+template <>
+__attribute__((target("avx2"))) inline __m256i addAvx2<uint32_t>(__m256i work, __m256i allocation) { return _mm256_add_epi32(work, allocation); }
+template <>
+__attribute__((target("avx2"))) inline __m256i addAvx2<int64_t>(__m256i work, __m256i allocation) { return _mm256_add_epi64(work, allocation); }
+template <>
+__attribute__((target("avx2"))) inline __m256i addAvx2<uint16_t>(__m256i work, __m256i allocation) { return _mm256_add_epi16(work, allocation); }
+
+// AVX-512 compares straight into a mask register and has unsigned compares
+template <typename T>
+bool overAvx512(__m512i need, __m512i work);
+template <typename T>
+__m512i addAvx512(__m512i work, __m512i allocation);
+
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline bool overAvx512<int32_t>(__m512i need, __m512i work) { return _mm512_cmpgt_epi32_mask(need, work) != 0; }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline bool overAvx512<uint32_t>(__m512i need, __m512i work) { return _mm512_cmpgt_epu32_mask(need, work) != 0; }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline bool overAvx512<int64_t>(__m512i need, __m512i work) { return _mm512_cmpgt_epi64_mask(need, work) != 0; }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline bool overAvx512<uint16_t>(__m512i need, __m512i work) { return _mm512_cmpgt_epu16_mask(need, work) != 0; }
+
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline __m512i addAvx512<int32_t>(__m512i work, __m512i allocation) { return _mm512_add_epi32(work, allocation); }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline __m512i addAvx512<uint32_t>(__m512i work, __m512i allocation) { return _mm512_add_epi32(work, allocation); }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline __m512i addAvx512<int64_t>(__m512i work, __m512i allocation) { return _mm512_add_epi64(work, allocation); }
+template <>
+__attribute__((target("avx512f,avx512bw"))) inline __m512i addAvx512<uint16_t>(__m512i work, __m512i allocation) { return _mm512_add_epi16(work, allocation); }
+
+template <typename T>
+__attribute__((target("sse4.2"))) static bool fitsSse42(const T *need, const T *work, size_t length)
+{
+    constexpr size_t lanes = 16 / sizeof(T);
+
+    // One cache line per iteration, so a blocked row is rejected after the first line that exceeds work
+    for (size_t k = 0; k < length; k += 4 * lanes)
+    {
+        __m128i over = _mm_setzero_si128();
+        for (size_t part = 0; part < 4; ++part)
+        {
+            __m128i n = _mm_load_si128((const __m128i *)(need + k + part * lanes));
+            __m128i w = _mm_load_si128((const __m128i *)(work + k + part * lanes));
+            over = _mm_or_si128(over, overSse42<T>(n, w));
+        }
+        if (!_mm_testz_si128(over, over))
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+__attribute__((target("sse4.2"))) static void addSse42(T *work, const T *allocation, size_t length)
+{
+    constexpr size_t lanes = 16 / sizeof(T);
+
+    for (size_t k = 0; k < length; k += lanes)
+    {
+        __m128i sum = addSse42<T>(_mm_load_si128((const __m128i *)(work + k)), _mm_load_si128((const __m128i *)(allocation + k)));
+        _mm_store_si128((__m128i *)(work + k), sum);
+    }
+}
+
+template <typename T>
+__attribute__((target("avx2"))) static bool fitsAvx2(const T *need, const T *work, size_t length)
+{
+    constexpr size_t lanes = 32 / sizeof(T);
+
+    for (size_t k = 0; k < length; k += 2 * lanes)
+    {
+        __m256i over = overAvx2<T>(_mm256_load_si256((const __m256i *)(need + k)), _mm256_load_si256((const __m256i *)(work + k)));
+        over = _mm256_or_si256(over, overAvx2<T>(_mm256_load_si256((const __m256i *)(need + k + lanes)), _mm256_load_si256((const __m256i *)(work + k + lanes))));
+        if (!_mm256_testz_si256(over, over))
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+__attribute__((target("avx2"))) static void addAvx2(T *work, const T *allocation, size_t length)
+{
+    constexpr size_t lanes = 32 / sizeof(T);
+
+    for (size_t k = 0; k < length; k += lanes)
+    {
+        __m256i sum = addAvx2<T>(_mm256_load_si256((const __m256i *)(work + k)), _mm256_load_si256((const __m256i *)(allocation + k)));
+        _mm256_store_si256((__m256i *)(work + k), sum);
+    }
+}
+
+template <typename T>
+__attribute__((target("avx512f,avx512bw"))) static bool fitsAvx512(const T *need, const T *work, size_t length)
+{
+    constexpr size_t lanes = 64 / sizeof(T);
+
+    for (size_t k = 0; k < length; k += lanes)
+    {
+        if (overAvx512<T>(_mm512_load_si512(need + k), _mm512_load_si512(work + k)))
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+__attribute__((target("avx512f,avx512bw"))) static void addAvx512(T *work, const T *allocation, size_t length)
+{
+    constexpr size_t lanes = 64 / sizeof(T);
+
+    for (size_t k = 0; k < length; k += lanes)
+        _mm512_store_si512(work + k, addAvx512<T>(_mm512_load_si512(work + k), _mm512_load_si512(allocation + k)));
+}
+#endif
+
+// Counter types with vectorized kernels; any other type runs the scalar loops
+template <typename T>
+constexpr bool hasVectorKernels = is_same<T, int32_t>::value || is_same<T, uint32_t>::value ||
+                                  is_same<T, int64_t>::value || is_same<T, uint16_t>::value;
+
+// Picks the widest kernels the running CPU supports, once per counter type
+template <typename T>
+static const RowKernels<T> &rowKernels()
+{
+    static const RowKernels<T> kernels = []() -> RowKernels<T>
+    {
+#ifdef BANKER_X86_DISPATCH
+        if constexpr (hasVectorKernels<T>)
+        {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                return {fitsAvx512<T>, addAvx512<T>};
+            if (__builtin_cpu_supports("avx2"))
+                return {fitsAvx2<T>, addAvx2<T>};
+            if (__builtin_cpu_supports("sse4.2"))
+                return {fitsSse42<T>, addSse42<T>};
+        }
+#endif
+        return {fitsScalar<T>, addScalar<T>};
+    }();
+    return kernels;
+}
+
+// True when a + b does not fit in T; b must not be negative
+template <typename T>
+bool sumOverflows(T a, T b)
+{
+    return a > numeric_limits<T>::max() - b;
+}
+
+// Storage for any number of resource types, chosen at run time. Rows live in
+// Matrix blocks and are compared and accumulated with the vectorized RowKernels.
+template <typename T>
+class DenseStorage
+{
+public:
+    using Counter = T;
+    // Work and available vectors, padded to the matrix stride like every row
+    using Row = vector<T, AlignedAllocator<T>>;
+
+private:
+    Matrix<T> allocation;
+    Matrix<T> max;
+    Matrix<T> need; // max - allocation, kept up to date by every grant and release
+    const RowKernels<T> *kernels = &rowKernels<T>();
+
+public:
+    DenseStorage(const vector<vector<T>> &allocation, const vector<vector<T>> &max)
+        : allocation(allocation), max(max), need(allocation.size(), allocation[0].size())
+    {
+        for (size_t i = 0; i < need.rows(); ++i)
+        {
+            for (size_t j = 0; j < need.cols(); ++j)
+            {
+                need[i][j] = max[i][j] - allocation[i][j];
+            }
+        }
+    }
+
+    size_t processes() const { return allocation.rows(); }
+    size_t resourceTypes() const { return allocation.cols(); }
+
+    Row makeRow(const vector<T> &values) const
+    {
+        Row row(allocation.stride(), 0);
+        copy(values.begin(), values.end(), row.begin());
+        return row;
+    }
+
+    T allocationAt(size_t i, size_t j) const { return allocation[i][j]; }
+    T maxAt(size_t i, size_t j) const { return max[i][j]; }
+    T needAt(size_t i, size_t j) const { return need[i][j]; }
+
+    // Number of stored cells; cell indices are stable for the lifetime of the storage
+    size_t cells() const { return need.rows() * need.stride(); }
+
+    // Calls visit(resource, cell, need) for every resource process i has a nonzero max claim on
+    template <typename F>
+    void forEachClaim(size_t i, F visit) const
+    {
+        for (size_t j = 0; j < max.cols(); ++j)
+        {
+            if (max[i][j] != T())
+                visit(j, i * need.stride() + j, need[i][j]);
+        }
+    }
+
+    // True when process i could run to completion with work
+    bool fits(size_t i, const Row &work) const
+    {
+        return kernels->fits(need[i], work.data(), need.stride());
+    }
+
+    // Returns the allocation of process i to work
+    void addAllocation(size_t i, Row &work) const
+    {
+        kernels->add(work.data(), allocation[i], allocation.stride());
+    }
+
+    // Moves units from the outstanding need of process i into its allocation
+    void grant(size_t i, const vector<T> &units)
+    {
+        for (size_t j = 0; j < units.size(); ++j)
+        {
+            allocation[i][j] += units[j];
+            need[i][j] -= units[j];
+        }
+    }
+
+    // Moves units from the allocation of process i back into its outstanding need
+    void revoke(size_t i, const vector<T> &units)
+    {
+        for (size_t j = 0; j < units.size(); ++j)
+        {
+            allocation[i][j] -= units[j];
+            need[i][j] += units[j];
+        }
+    }
+
+    // Copies the counters that grants and releases change from a storage built from
+    // the same matrices, reusing this storage's buffers: one memcpy per matrix
+    void copyCountersFrom(const DenseStorage &other)
+    {
+        allocation = other.allocation;
+        need = other.need;
+    }
+
+    // As copyCountersFrom, for the row of process i only
+    void copyRowFrom(const DenseStorage &other, size_t i)
+    {
+        copy_n(other.allocation[i], allocation.stride(), allocation[i]);
+        copy_n(other.need[i], need.stride(), need[i]);
+    }
+};
+
+// Storage for exactly R resource types, fixed at compile time. Rows are
+// std::array values held inline in one vector per matrix, and the row
+// comparisons and sums are unrolled over the R columns.
+template <typename T, size_t R>
+class FixedStorage
+{
+public:
+    using Counter = T;
+    using Row = array<T, R>;
+
+private:
+    vector<Row> allocation;
+    vector<Row> max;
+    vector<Row> need; // max - allocation, kept up to date by every grant and release
+
+    // Shorter rows are zero-filled like DenseStorage pads them; longer ones would lose a resource type
+    static Row toRow(const vector<T> &values)
+    {
+        if (values.size() > R)
+            throw invalid_argument("FixedStorage: row has more than R resource types");
+        Row row{};
+        copy(values.begin(), values.end(), row.begin());
+        return row;
+    }
+
+    template <size_t... J>
+    static bool fitsAll(const Row &need, const Row &work, index_sequence<J...>)
+    {
+        return ((need[J] <= work[J]) && ...);
+    }
+
+    template <size_t... J>
+    static void addAll(Row &work, const Row &allocation, index_sequence<J...>)
+    {
+        ((work[J] += allocation[J]), ...);
+    }
+
+public:
+    FixedStorage(const vector<vector<T>> &allocation, const vector<vector<T>> &max)
+    {
+        if (allocation.size() != max.size())
+            throw invalid_argument("FixedStorage: allocation and max differ in process count");
+
+        for (size_t i = 0; i < allocation.size(); ++i)
+        {
+            if (allocation[i].size() != R || max[i].size() != R)
+                throw invalid_argument("FixedStorage: matrix row width is not R");
+
+            this->allocation.push_back(toRow(allocation[i]));
+            this->max.push_back(toRow(max[i]));
+
+            Row remaining{};
+            for (size_t j = 0; j < R; ++j)
+                remaining[j] = this->max[i][j] - this->allocation[i][j];
+            need.push_back(remaining);
+        }
+    }
+
+    size_t processes() const { return allocation.size(); }
+    size_t resourceTypes() const { return R; }
+
+    Row makeRow(const vector<T> &values) const { return toRow(values); }
+
+    T allocationAt(size_t i, size_t j) const { return allocation[i][j]; }
+    T maxAt(size_t i, size_t j) const { return max[i][j]; }
+    T needAt(size_t i, size_t j) const { return need[i][j]; }
+
+    size_t cells() const { return need.size() * R; }
+
+    template <typename F>
+    void forEachClaim(size_t i, F visit) const
+    {
+        for (size_t j = 0; j < R; ++j)
+        {
+            if (max[i][j] != T())
+                visit(j, i * R + j, need[i][j]);
+        }
+    }
+
+    bool fits(size_t i, const Row &work) const
+    {
+        return fitsAll(need[i], work, make_index_sequence<R>());
+    }
+
+    void addAllocation(size_t i, Row &work) const
+    {
+        addAll(work, allocation[i], make_index_sequence<R>());
+    }
+
+    void grant(size_t i, const vector<T> &units)
+    {
+        for (size_t j = 0; j < units.size(); ++j)
+        {
+            allocation[i][j] += units[j];
+            need[i][j] -= units[j];
+        }
+    }
+
+    void revoke(size_t i, const vector<T> &units)
+    {
+        for (size_t j = 0; j < units.size(); ++j)
+        {
+            allocation[i][j] -= units[j];
+            need[i][j] += units[j];
+        }
+    }
+
+    void copyCountersFrom(const FixedStorage &other)
+    {
+        allocation = other.allocation;
+        need = other.need;
+    }
+
+    void copyRowFrom(const FixedStorage &other, size_t i)
+    {
+        allocation[i] = other.allocation[i];
+        need[i] = other.need[i];
+    }
+};
+
+// Storage for large, mostly empty claim matrices. Each process row keeps only
+// the resources it has a nonzero max claim on, in CSR form: the entries of row
+// i are rowStart[i] .. rowStart[i + 1] - 1, sorted by resource. Allocation and
+// need never leave the max pattern, so the pattern is fixed at construction,
+// and the safety check touches only the claimed entries of each row.
+template <typename T>
+class SparseStorage
+{
+public:
+    using Counter = T;
+    using Row = vector<T>;
+
+private:
+    size_t numResources = 0;
+    vector<size_t> rowStart;
+    vector<uint32_t> resource;
+    vector<T> allocation;
+    vector<T> max;
+    vector<T> need; // max - allocation, kept up to date by every grant and release
+
+    // Entry for resource j in row i, or -1 when the process has no claim on it
+    long find(size_t i, size_t j) const
+    {
+        auto begin = resource.begin() + rowStart[i];
+        auto end = resource.begin() + rowStart[i + 1];
+        auto it = lower_bound(begin, end, j);
+        return it != end && *it == j ? it - resource.begin() : -1;
+    }
+
+public:
+    SparseStorage(const vector<vector<T>> &allocation, const vector<vector<T>> &max)
+        : numResources(allocation[0].size())
+    {
+        rowStart.push_back(0);
+        for (size_t i = 0; i < max.size(); ++i)
+        {
+            for (size_t j = 0; j < numResources; ++j)
+            {
+                if (max[i][j] != T())
+                {
+                    resource.push_back(j);
+                    this->allocation.push_back(allocation[i][j]);
+                    this->max.push_back(max[i][j]);
+                    need.push_back(max[i][j] - allocation[i][j]);
+                }
+            }
+            rowStart.push_back(resource.size());
+        }
+    }
+
+    size_t processes() const { return rowStart.size() - 1; }
+    size_t resourceTypes() const { return numResources; }
+
+    Row makeRow(const vector<T> &values) const
+    {
+        Row row(numResources, 0);
+        copy(values.begin(), values.end(), row.begin());
+        return row;
+    }
+
+    T allocationAt(size_t i, size_t j) const
+    {
+        long e = find(i, j);
+        return e < 0 ? T() : allocation[e];
+    }
+
+    T maxAt(size_t i, size_t j) const
+    {
+        long e = find(i, j);
+        return e < 0 ? T() : max[e];
+    }
+
+    T needAt(size_t i, size_t j) const
+    {
+        long e = find(i, j);
+        return e < 0 ? T() : need[e];
+    }
+
+    size_t cells() const { return resource.size(); }
+
+    template <typename F>
+    void forEachClaim(size_t i, F visit) const
+    {
+        for (size_t e = rowStart[i]; e < rowStart[i + 1]; ++e)
+            visit(resource[e], e, need[e]);
+    }
+
+    bool fits(size_t i, const Row &work) const
+    {
+        for (size_t e = rowStart[i]; e < rowStart[i + 1]; ++e)
+        {
+            if (need[e] > work[resource[e]])
+                return false;
+        }
+        return true;
+    }
+
+    void addAllocation(size_t i, Row &work) const
+    {
+        for (size_t e = rowStart[i]; e < rowStart[i + 1]; ++e)
+            work[resource[e]] += allocation[e];
+    }
+
+    // Units outside the row's claims are always zero: they are bounded by need or allocation
+    void grant(size_t i, const vector<T> &units)
+    {
+        for (size_t e = rowStart[i]; e < rowStart[i + 1] && resource[e] < units.size(); ++e)
+        {
+            allocation[e] += units[resource[e]];
+            need[e] -= units[resource[e]];
+        }
+    }
+
+    void revoke(size_t i, const vector<T> &units)
+    {
+        for (size_t e = rowStart[i]; e < rowStart[i + 1] && resource[e] < units.size(); ++e)
+        {
+            allocation[e] -= units[resource[e]];
+            need[e] += units[resource[e]];
+        }
+    }
+
+    // The claim pattern never changes, so only the CSR values are copied
+    void copyCountersFrom(const SparseStorage &other)
+    {
+        allocation = other.allocation;
+        need = other.need;
+    }
+
+    void copyRowFrom(const SparseStorage &other, size_t i)
+    {
+        copy(other.allocation.begin() + rowStart[i], other.allocation.begin() + rowStart[i + 1], allocation.begin() + rowStart[i]);
+        copy(other.need.begin() + rowStart[i], other.need.begin() + rowStart[i + 1], need.begin() + rowStart[i]);
+    }
+};
+
+// Fixed set of worker threads that run one indexed batch of tasks at a time.
+// The submitting thread works on the batch too and returns once it is done.
+class ThreadPool
+{
+private:
+    vector<thread> workers;
+    mutex mtx;
+    mutex submitMtx; // one batch at a time
+    condition_variable wake;
+    condition_variable done;
+    const function<void(size_t)> *job = nullptr;
+    size_t jobTasks = 0;
+    atomic<size_t> nextTask{0};
+    size_t busyWorkers = 0;
+    size_t generation = 0;
+    bool stopping = false;
+
+    void runTasks()
+    {
+        for (size_t task = nextTask++; task < jobTasks; task = nextTask++)
+            (*job)(task);
+    }
+
+    void workerLoop()
+    {
+        size_t seen = 0;
+        unique_lock<mutex> lock(mtx);
+        while (true)
+        {
+            wake.wait(lock, [&]
+                      { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+
+            lock.unlock();
+            runTasks();
+            lock.lock();
+
+            if (--busyWorkers == 0)
+                done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads)
+    {
+        for (size_t t = 0; t < threads; ++t)
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    // Worker threads plus the submitting thread
+    size_t concurrency() const { return workers.size() + 1; }
+
+    // Runs task(0) .. task(tasks - 1) across the pool and waits for all of them
+    void parallelFor(size_t tasks, const function<void(size_t)> &task)
+    {
+        lock_guard<mutex> submit(submitMtx);
+        {
+            lock_guard<mutex> lock(mtx);
+            job = &task;
+            jobTasks = tasks;
+            nextTask = 0;
+            busyWorkers = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        runTasks();
+
+        unique_lock<mutex> lock(mtx);
+        done.wait(lock, [&]
+                  { return busyWorkers == 0; });
+        job = nullptr;
+    }
+};
+
+// Epoch-based reclamation for objects that readers reach without a lock. A reader
+// announces the global epoch in a slot while it holds a pointer; an object retired
+// at epoch t may be reused once no slot announces an epoch of t or earlier.
+class EpochDomain
+{
+private:
+    struct alignas(64) Slot
+    {
+        atomic<uint64_t> epoch{0}; // 0 while the slot is free
+    };
+
+    array<Slot, 64> slots;
+    atomic<uint64_t> globalEpoch{1};
+
+public:
+    // Claims a slot for the calling reader; load the shared pointer after this.
+    // With every slot taken it yields after each sweep until a reader leaves.
+    size_t enter()
+    {
+        size_t start = hash<thread::id>()(this_thread::get_id());
+        for (size_t k = start;; ++k)
+        {
+            Slot &slot = slots[k % slots.size()];
+            uint64_t free = 0;
+            if (slot.epoch.compare_exchange_strong(free, globalEpoch.load()))
+                return k % slots.size();
+            if ((k - start) % slots.size() == slots.size() - 1)
+                this_thread::yield();
+        }
+    }
+
+    void exit(size_t slot)
+    {
+        slots[slot].epoch.store(0);
+    }
+
+    // Called after the shared pointer stopped pointing at an object; returns its tag
+    uint64_t retire()
+    {
+        return globalEpoch.fetch_add(1);
+    }
+
+    // Smallest epoch announced by an active reader, or the current epoch if none is active
+    uint64_t oldestActive() const
+    {
+        uint64_t oldest = globalEpoch.load();
+        for (const Slot &slot : slots)
+        {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0)
+                oldest = std::min(oldest, epoch);
+        }
+        return oldest;
+    }
+};
+
+// Which requests of a batch requestResourcesBatch grants
+enum class BatchAdmission
+{
+    LargestPrefix, // The longest prefix whose grants are safe together, by binary search
+    Greedy         // Every request that is still safe on top of the ones granted before it
+};
+
+// Safety check implementations a BankersAlgorithm can run
+enum class SafetyAlgorithm
+{
+    Scan,     // Rescan every unfinished process until a full pass makes no progress, O(n^2 * m)
+    Indexed,  // Habermann-style per-resource need ordering with a worklist, O(n * m * log n)
+    Parallel  // Scan rounds split across a thread pool; Scan below the parallel threshold
+};
+
+// Order in which blocked acquireResources* callers are admitted when a release or grant
+// unblocks several of them. Waiting time ages every waiter towards the front.
+enum class AdmissionPolicy
+{
+    Fifo,             // Arrival order
+    Priority,         // Highest priority first; one level gained per aging interval
+    ShortestNeedFirst, // Fewest requested units first; the effective size halves per aging interval
+    DominantResourceFairness // Tenant with the smallest dominant share of resources first; no aging
+};
+
+// The banker over a storage policy (DenseStorage, FixedStorage or SparseStorage), which owns
+// the allocation, max and need matrices and the row operations on them
+template <typename Storage>
+class BasicBankersAlgorithm
+{
+public:
+    using Counter = typename Storage::Counter;
+
+    // Immutable copy of the banker's counters, as published after a change. The
+    // matrices stay in the storage's own layout, so publishing copies them wholesale.
+    struct Snapshot
+    {
+        uint64_t version; // number of grants and releases before it was taken
+        int processes;
+        int resourceTypes;
+        Storage state;
+        vector<Counter> available; // resourceTypes entries
+        vector<Counter> resources;
+
+        explicit Snapshot(const Storage &state)
+            : processes(state.processes()), resourceTypes(state.resourceTypes()), state(state) {}
+
+        Counter allocationAt(int i, int j) const { return state.allocationAt(i, j); }
+        Counter maxAt(int i, int j) const { return state.maxAt(i, j); }
+        Counter needAt(int i, int j) const { return state.needAt(i, j); }
+    };
+
+private:
+    using Row = typename Storage::Row;
+
+    Storage state;
+    Row available;
+    Row resources;
+    // available plus every allocation. No work vector in a safety check can
+    // exceed it, so keeping it representable rules out overflow in the checks.
+    Row inCirculation;
+    vector<bool> completed;
+    SafetyAlgorithm safetyAlgorithm = SafetyAlgorithm::Scan;
+
+    // Processes and resources linked by nonzero max entries. Components share no
+    // resource, so the state is safe exactly when each component is safe on its
+    // own, and a request only has to be checked against its own component.
+    struct Component
+    {
+        vector<int> processes;
+        vector<int> resources;
+        // Order in which every process of the component could finish, from the last check that found it safe
+        vector<int> safeSequence;
+        // Whether the component is known to be safe. Grants only commit into a safe state
+        // and releases never make one unsafe, so once set it stays set.
+        bool sequenceHolds = false;
+        // Set when a grant was taken on a remembered verdict without checking safeSequence,
+        // which may then no longer work; the next successful check replaces it
+        bool orderStale = false;
+        bool envelopesFresh = false;
+    };
+
+    vector<Component> components;
+    vector<int> componentOf; // per process
+    int componentsNotHolding = 0;
+    vector<int> candidateSequence; // scratch for searches that may fail
+    // Per process, row-major: units that can be granted right now without a safety
+    // search, derived from its component's safeSequence. Grants and releases only ever
+    // widen the true envelopes, so stored ones stay valid (if conservative) until the
+    // order changes.
+    vector<Counter> envelopes;
+    // Pools with fewer processes than this run the Parallel algorithm serially
+    size_t parallelThreshold = 4096;
+    unique_ptr<ThreadPool> pool;
+
+    // What a safety search needs from the configuration, read under mtx so that
+    // searches running with mtx released never touch the members themselves
+    struct SafetySettings
+    {
+        SafetyAlgorithm algorithm;
+        size_t parallelThreshold;
+        ThreadPool *pool; // null until Parallel is first selected
+    };
+
+    SafetySettings safetySettings() const
+    {
+        return {safetyAlgorithm, parallelThreshold, pool.get()};
+    }
+    // Mutating calls hold mtx exclusively; printing and safety queries share it
+    shared_mutex mtx;
+
+    uint64_t stateVersion = 0; // bumped by every grant and release
+    // Bumped by every grant. Releases keep a safe state safe, so a safety verdict
+    // reached on a copy still holds at commit time if no grant came in between.
+    uint64_t grantVersion = 0;
+    int optimisticRetries = 4;
+    // Per process: stateVersion of the last grant or release that changed its row
+    vector<uint64_t> rowVersion;
+    // Private copies of the state for optimistic searches, kept between calls. A search
+    // brings only the rows of its component up to date, and only those that changed
+    // since its buffer last copied them; max is copied once, when the buffer is made.
+    struct SearchBuffer
+    {
+        Storage state;
+        vector<uint64_t> rowVersion; // per process: the rowVersion its row in state was copied at
+        Row work;
+        vector<int> order;
+        vector<int> sequence;
+
+        SearchBuffer(const Storage &state, const vector<uint64_t> &rowVersion) : state(state), rowVersion(rowVersion) {}
+    };
+    // Idle buffers, so there are only as many as threads ever searched at once
+    vector<unique_ptr<SearchBuffer>> searchBuffers;
+    mutex searchBuffersMtx;
+    // Per process, the frontier of requests recently found safe or unsafe
+    struct Verdicts
+    {
+        vector<vector<Counter>> safe;            // maximal requests known to be safe
+        vector<pair<vector<Counter>, int>> unsafe; // minimal requests found unsafe, with the failing component
+        uint64_t unsafeVersion = 0;             // stateVersion the unsafe entries were found in
+    };
+
+    static const size_t verdictsPerProcess = 4;
+    vector<Verdicts> verdicts;
+
+    // Zobrist hash of allocation and available, kept up to date in O(m) per change
+    uint64_t stateHash = 0;
+
+    // Safety verdicts by hash of the state checked. A 64-bit collision between two
+    // different states is possible in principle and is accepted as negligible.
+    struct CachedVerdict
+    {
+        int blocker;         // component that was unsafe, or -1 if the state was safe
+        int component;       // component the safe order below belongs to
+        vector<int> sequence;
+    };
+
+    unordered_map<uint64_t, CachedVerdict> safetyCache;
+    vector<uint64_t> safetyCacheKeys; // in insertion order, as a ring once full
+    size_t safetyCacheNext = 0;
+    size_t safetyCacheCapacity = 1024;
+    uint64_t safetyCacheHits = 0;
+    uint64_t safetyCacheMisses = 0;
+
+    // wouldGrant spreads its searches over the thread pool from this many candidates on
+    size_t parallelCandidates = 16;
+
+    // Flat combining: callers publish an operation in a slot, and whoever holds mtx
+    // applies every published one, so the banker state stays in one core's cache
+    struct alignas(64) CombiningSlot
+    {
+        enum Phase
+        {
+            Free,
+            Filling,
+            Pending,
+            Done
+        };
+
+        atomic<int> phase{Free};
+        bool release;
+        int processId;
+        const vector<Counter> *units;
+        bool result;
+    };
+
+    array<CombiningSlot, 64> combiningSlots;
+    // Snapshot publication, off until enableSnapshots(). Buffers live in snapshotBuffers
+    // and move between the published one, the retired ones and the spare ones.
+    unique_ptr<EpochDomain> epochs;
+    atomic<Snapshot *> published{nullptr};
+    list<Snapshot> snapshotBuffers;
+    vector<pair<uint64_t, Snapshot *>> retiredSnapshots;
+    vector<Snapshot *> spareSnapshots;
+    // Every stateVersion bump changes one process row. dirtyLog holds that process for
+    // each version after dirtyLogBase, so a recycled buffer only copies the rows changed
+    // since its own version; rowVersion tells which entry is a row's latest change.
+    deque<int> dirtyLog;
+    uint64_t dirtyLogBase = 0;
+
+    enum class GrantResult
+    {
+        Granted,
+        Blocked, // not grantable now, but may become so after releases
+        Rejected // can never be granted as asked
+    };
+
+    // A thread parked in acquireResources*. It sleeps on its own condition variable
+    // and is only signalled by a change that can possibly let its request through.
+    struct Waiter
+    {
+        int processId;
+        const vector<Counter> *request;
+        int priority;
+        uint64_t ticket; // arrival order
+        chrono::steady_clock::time_point since;
+        condition_variable_any wake;
+        bool signalled = false;
+        GrantResult outcome = GrantResult::Blocked; // decided for the waiter by an admission pass
+        // Resources whose request exceeds available, with the waiter's entry in deficitWaiters
+        vector<pair<int, typename multimap<Counter, Waiter *>::iterator>> deficits;
+        // Component whose unsafety blocked the request, with the waiter's entry in safetyWaiters
+        int safetyComponent = -1;
+        typename list<Waiter *>::iterator safetyPosition;
+
+        Waiter(int processId, const vector<Counter> &request, int priority, uint64_t ticket)
+            : processId(processId), request(&request), priority(priority), ticket(ticket),
+              since(chrono::steady_clock::now()) {}
+    };
+
+    // Per resource, waiters keyed by the level of available they need it to reach
+    vector<multimap<Counter, Waiter *>> deficitWaiters;
+    // Per component, waiters whose request was available but unsafe
+    vector<list<Waiter *>> safetyWaiters;
+    // Waiters taken out of the indexes by the current change, awaiting an admission pass
+    vector<Waiter *> candidates;
+    uint64_t nextTicket = 0;
+
+    AdmissionPolicy admissionPolicy = AdmissionPolicy::Fifo;
+    chrono::steady_clock::duration agingInterval = chrono::milliseconds(100);
+    // A waiter blocked this long is tried before anyone else in every pass
+    chrono::steady_clock::duration starvationLimit = chrono::seconds(1);
+
+    // Dominant Resource Fairness accounting, kept only under that admission policy.
+    // A tenant's share is the largest fraction of resources[j] its processes hold.
+    struct Tenant
+    {
+        Row allocation;
+        double share = 0;
+        uint64_t shareVersion = 0; // resourcesVersion the share was computed against
+
+        explicit Tenant(Row allocation) : allocation(std::move(allocation)) {}
+    };
+
+    vector<int> tenantOf;
+    vector<Tenant> tenants;
+    // Bumped whenever resources changes, which invalidates every share at once
+    uint64_t resourcesVersion = 1;
+
+    // Union-find over processes (0 .. n-1) and resources (n .. n+m-1)
+    void findComponents()
+    {
+        int numProcesses = state.processes();
+        int numResources = state.resourceTypes();
+
+        vector<int> parent(numProcesses + numResources);
+        iota(parent.begin(), parent.end(), 0);
+        auto root = [&](int node)
+        {
+            while (parent[node] != node)
+                node = parent[node] = parent[parent[node]];
+            return node;
+        };
+
+        for (int i = 0; i < numProcesses; ++i)
+        {
+            state.forEachClaim(i, [&](int j, size_t, Counter)
+                               { parent[root(i)] = root(numProcesses + j); });
+        }
+
+        vector<int> index(numProcesses + numResources, -1);
+        componentOf.resize(numProcesses);
+        for (int node = 0; node < numProcesses + numResources; ++node)
+        {
+            int r = root(node);
+            if (index[r] < 0)
+            {
+                // A resource nobody claims forms no component of its own
+                if (node >= numProcesses && r == node)
+                    continue;
+                index[r] = components.size();
+                components.emplace_back();
+            }
+
+            if (node < numProcesses)
+            {
+                components[index[r]].processes.push_back(node);
+                componentOf[node] = index[r];
+            }
+            else
+            {
+                components[index[r]].resources.push_back(node - numProcesses);
+            }
+        }
+
+        componentsNotHolding = components.size();
+    }
+
+    // The engines read the state they are given, which is the live one except for
+    // optimistic requests, which check a private copy with mtx released
+    bool isSafeStateScan(const Storage &state, const Row &available, const Component &component, vector<int> &sequence)
+    {
+        const vector<int> &processes = component.processes;
+        int numProcesses = processes.size();
+
+        vector<bool> safe(numProcesses, false);
+        Row work = available;
+        sequence.clear();
+
+        bool finished;
+        int count = 0;
+
+        do
+        {
+            finished = true;
+
+            for (int k = 0; k < numProcesses; ++k)
+            {
+                if (safe[k])
+                    continue;
+
+                int i = processes[k];
+                if (state.fits(i, work))
+                {
+                    safe[k] = true;
+                    sequence.push_back(i);
+                    state.addAllocation(i, work);
+                    finished = false;
+                    count++;
+                }
+            }
+        } while (!finished && count < numProcesses);
+
+        if (count < numProcesses)
+        {
+            return false; // Deadlock detected
+        }
+
+        for (bool isSafe : safe)
+        {
+            if (!isSafe)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool isSafeStateIndexed(const Storage &state, const Row &available, const Component &component, vector<int> &sequence)
+    {
+        const vector<int> &processes = component.processes;
+        const vector<int> &resources = component.resources;
+        int numProcesses = processes.size();
+        int numResources = resources.size();
+
+        Row work = available;
+        sequence.clear();
+
+        // For every resource, the processes (as positions in the component) ordered by how much of it they still need
+        vector<vector<int>> byNeed(numResources, vector<int>(numProcesses));
+        // Position of the first process in byNeed[r] whose need still exceeds work
+        vector<int> next(numResources, 0);
+        // Number of resources whose need is already covered by work, per process
+        vector<int> covered(numProcesses, 0);
+        vector<int> runnable;
+
+        auto advance = [&](int r)
+        {
+            int j = resources[r];
+            while (next[r] < numProcesses && state.needAt(processes[byNeed[r][next[r]]], j) <= work[j])
+            {
+                int k = byNeed[r][next[r]++];
+                if (++covered[k] == numResources)
+                    runnable.push_back(k);
+            }
+        };
+
+        if (numResources == 0)
+        {
+            runnable.resize(numProcesses);
+            iota(runnable.begin(), runnable.end(), 0);
+        }
+
+        for (int r = 0; r < numResources; ++r)
+        {
+            int j = resources[r];
+            iota(byNeed[r].begin(), byNeed[r].end(), 0);
+            sort(byNeed[r].begin(), byNeed[r].end(), [&](int a, int b)
+                 { return state.needAt(processes[a], j) < state.needAt(processes[b], j); });
+            advance(r);
+        }
+
+        int count = 0;
+
+        // Only resources a finishing process actually returns can unblock anyone else
+        while (!runnable.empty())
+        {
+            int i = processes[runnable.back()];
+            runnable.pop_back();
+            sequence.push_back(i);
+            count++;
+
+            for (int r = 0; r < numResources; ++r)
+            {
+                int j = resources[r];
+                if (state.allocationAt(i, j) != 0)
+                {
+                    work[j] += state.allocationAt(i, j);
+                    advance(r);
+                }
+            }
+        }
+
+        return count == numProcesses; // Otherwise deadlock detected
+    }
+
+    // Every round, each partition of the process rows collects the processes that fit
+    // the current work together with the sum of their allocations. Everything found
+    // in a round can finish, since work only grows, so the partial sums are then
+    // reduced into work and the next round starts.
+    bool isSafeStateParallel(const Storage &state, const Row &available, const Component &component, vector<int> &sequence,
+                             const SafetySettings &settings)
+    {
+        const vector<int> &processes = component.processes;
+        size_t numProcesses = processes.size();
+        int numResources = state.resourceTypes();
+
+        sequence.clear();
+        if (!settings.pool || numProcesses < settings.parallelThreshold)
+            return isSafeStateScan(state, available, component, sequence);
+
+        ThreadPool &pool = *settings.pool;
+        size_t partitions = pool.concurrency();
+        size_t rowsPerPartition = (numProcesses + partitions - 1) / partitions;
+
+        vector<char> finished(numProcesses, 0); // not vector<bool>, partitions write it concurrently
+        vector<vector<int>> found(partitions);
+        vector<Row> returned(partitions, state.makeRow({}));
+        Row work = available;
+
+        function<void(size_t)> scanPartition = [&](size_t part)
+        {
+            size_t begin = part * rowsPerPartition;
+            size_t end = std::min(numProcesses, begin + rowsPerPartition);
+
+            found[part].clear();
+            fill(returned[part].begin(), returned[part].end(), Counter());
+            for (size_t k = begin; k < end; ++k)
+            {
+                if (!finished[k] && state.fits(processes[k], work))
+                {
+                    finished[k] = 1;
+                    found[part].push_back(processes[k]);
+                    state.addAllocation(processes[k], returned[part]);
+                }
+            }
+        };
+
+        while (sequence.size() < numProcesses)
+        {
+            size_t before = sequence.size();
+            pool.parallelFor(partitions, scanPartition);
+
+            for (size_t part = 0; part < partitions; ++part)
+            {
+                sequence.insert(sequence.end(), found[part].begin(), found[part].end());
+                for (int j = 0; j < numResources; ++j)
+                    work[j] += returned[part][j];
+            }
+
+            if (sequence.size() == before)
+                break; // Deadlock detected
+        }
+
+        return sequence.size() == numProcesses;
+    }
+
+    bool runSafetyAlgorithm(const Storage &state, const Row &available, const Component &component, vector<int> &sequence,
+                            const SafetySettings &settings)
+    {
+        if (settings.algorithm == SafetyAlgorithm::Indexed)
+            return isSafeStateIndexed(state, available, component, sequence);
+        else if (settings.algorithm == SafetyAlgorithm::Parallel)
+            return isSafeStateParallel(state, available, component, sequence, settings);
+        else
+            return isSafeStateScan(state, available, component, sequence);
+    }
+
+    // Runs the selected safety search over one component and remembers the order it finds
+    bool searchSafeSequence(int c)
+    {
+        Component &component = components[c];
+
+        bool safe = runSafetyAlgorithm(state, available, component, candidateSequence, safetySettings());
+
+        if (safe)
+        {
+            swap(component.safeSequence, candidateSequence);
+            component.envelopesFresh = false;
+            component.orderStale = false;
+        }
+        return safe;
+    }
+
+    // Single pass that replays a remembered order of the component against a state
+    bool replayOrder(const Storage &state, Row work, const Component &component, const vector<int> &order) const
+    {
+        if (order.size() != component.processes.size())
+            return false;
+
+        for (int i : order)
+        {
+            if (!state.fits(i, work))
+                return false;
+            state.addAllocation(i, work);
+        }
+
+        return true;
+    }
+
+    bool revalidateSafeSequence(int c)
+    {
+        if (!replayOrder(state, available, components[c], components[c].safeSequence))
+            return false;
+        components[c].orderStale = false;
+        return true;
+    }
+
+    // Most grants leave the previous order valid, so try it before searching
+    bool checkSafety(int c)
+    {
+        return revalidateSafeSequence(c) || searchSafeSequence(c);
+    }
+
+    void markHolds(int c)
+    {
+        if (!components[c].sequenceHolds)
+        {
+            components[c].sequenceHolds = true;
+            componentsNotHolding--;
+        }
+    }
+
+    // The first component other than `except` (-1 for none) that is unsafe, or -1
+    // when all of them are safe; components not yet known to be safe are searched
+    int firstUnsafeComponent(int except)
+    {
+        if (componentsNotHolding == 0 || (componentsNotHolding == 1 && except >= 0 && !components[except].sequenceHolds))
+            return -1;
+
+        for (size_t c = 0; c < components.size(); ++c)
+        {
+            if (static_cast<int>(c) == except || components[c].sequenceHolds)
+                continue;
+            if (!searchSafeSequence(c))
+                return c;
+            markHolds(c);
+        }
+        return -1;
+    }
+
+    // Walks the component's safeSequence once. Granting r to process p moves r out
+    // of work for every process before p in the order, so r is bounded by p's need,
+    // by available and by the slack (work - need) of each of those processes.
+    void refreshEnvelopes(int c)
+    {
+        computeEnvelopes(components[c], envelopes);
+        components[c].envelopesFresh = true;
+    }
+
+    void computeEnvelopes(const Component &component, vector<Counter> &bounds) const
+    {
+        // Unclaimed resources have zero need: their envelope is zero and their slack
+        // is work itself, which never drops below available, so only claims are walked
+        Row work = available;
+        Row slack = available; // smallest slack of the processes walked so far
+        auto bound = [&](int j, size_t cell, Counter need)
+        {
+            bounds[cell] = std::min(need, slack[j]);
+            slack[j] = std::min<Counter>(slack[j], work[j] - need);
+        };
+
+        for (int i : component.safeSequence)
+        {
+            state.forEachClaim(i, bound);
+            state.addAllocation(i, work);
+        }
+    }
+
+    bool withinEnvelope(int processId, const vector<Counter> &request)
+    {
+        // Envelopes only preserve safety, so every component has to be known safe first
+        int c = componentOf[processId];
+        if (componentsNotHolding > 0 || components[c].orderStale)
+            return false;
+        if (!components[c].envelopesFresh)
+            refreshEnvelopes(c);
+
+        return envelopeCovers(processId, request);
+    }
+
+    // Read-only part of withinEnvelope, for envelopes known to be fresh
+    bool envelopeCovers(int processId, const vector<Counter> &request) const
+    {
+        return envelopeCovers(processId, request, envelopes);
+    }
+
+    bool envelopeCovers(int processId, const vector<Counter> &request, const vector<Counter> &bounds) const
+    {
+        // Requests on unclaimed resources are zero, since they are bounded by need
+        bool within = true;
+        state.forEachClaim(processId, [&](size_t j, size_t cell, Counter)
+                           { within = within && (j >= request.size() || request[j] <= bounds[cell]); });
+        return within;
+    }
+
+    // The waiter's request may have become grantable; the admission pass decides
+    void signalWaiter(Waiter &waiter)
+    {
+        candidates.push_back(&waiter);
+    }
+
+    // Indexes a waiter under whatever blocked it: every resource it is short of, or
+    // failing that the component whose safety check failed
+    void parkWaiter(Waiter &waiter, int blockedBy)
+    {
+        const vector<Counter> &request = *waiter.request;
+        waiter.signalled = false;
+
+        for (size_t j = 0; j < request.size(); ++j)
+        {
+            if (request[j] > available[j])
+                waiter.deficits.emplace_back(j, deficitWaiters[j].emplace(request[j], &waiter));
+        }
+
+        if (waiter.deficits.empty())
+        {
+            waiter.safetyComponent = blockedBy >= 0 ? blockedBy : componentOf[waiter.processId];
+            waiter.safetyPosition = safetyWaiters[waiter.safetyComponent].insert(safetyWaiters[waiter.safetyComponent].end(), &waiter);
+        }
+    }
+
+    // Removes a waiter that gave up from every index it is still in
+    void unparkWaiter(Waiter &waiter)
+    {
+        for (auto &deficit : waiter.deficits)
+            deficitWaiters[deficit.first].erase(deficit.second);
+        waiter.deficits.clear();
+
+        if (waiter.safetyComponent >= 0)
+        {
+            safetyWaiters[waiter.safetyComponent].erase(waiter.safetyPosition);
+            waiter.safetyComponent = -1;
+        }
+    }
+
+    // After available[j] grew, settles the deficits it now covers and signals the
+    // waiters that are no longer short of anything
+    void wakeDeficitWaiters(int j)
+    {
+        auto &index = deficitWaiters[j];
+        while (!index.empty() && index.begin()->first <= available[j])
+        {
+            Waiter *waiter = index.begin()->second;
+            index.erase(index.begin());
+
+            auto &deficits = waiter->deficits;
+            for (size_t d = 0; d < deficits.size(); ++d)
+            {
+                if (deficits[d].first == j)
+                {
+                    deficits[d] = deficits.back();
+                    deficits.pop_back();
+                    break;
+                }
+            }
+
+            if (deficits.empty())
+                signalWaiter(*waiter);
+        }
+    }
+
+    void wakeSafetyWaiters(int c)
+    {
+        for (Waiter *waiter : safetyWaiters[c])
+        {
+            waiter->safetyComponent = -1;
+            signalWaiter(*waiter);
+        }
+        safetyWaiters[c].clear();
+    }
+
+    // Copies the state into a recycled buffer and swaps it in for readers. Runs at the
+    // end of every mutating call, so a call that grants several waiters publishes once.
+    void publishSnapshot()
+    {
+        if (!epochs)
+            return;
+        Snapshot *current = published.load();
+        if (current && current->version == stateVersion)
+            return;
+
+        uint64_t oldest = epochs->oldestActive();
+        for (size_t k = 0; k < retiredSnapshots.size();)
+        {
+            if (retiredSnapshots[k].first < oldest)
+            {
+                spareSnapshots.push_back(retiredSnapshots[k].second);
+                retiredSnapshots[k] = retiredSnapshots.back();
+                retiredSnapshots.pop_back();
+            }
+            else
+            {
+                ++k;
+            }
+        }
+
+        Snapshot *snapshot;
+        if (spareSnapshots.empty())
+        {
+            snapshotBuffers.emplace_back(state);
+            snapshot = &snapshotBuffers.back();
+        }
+        else
+        {
+            snapshot = spareSnapshots.back();
+            spareSnapshots.pop_back();
+            refreshSnapshot(*snapshot);
+        }
+
+        // Rows may be padded past the last resource type; readers only get the real entries
+        int numResources = state.resourceTypes();
+        snapshot->version = stateVersion;
+        snapshot->available.assign(available.begin(), available.begin() + numResources);
+        snapshot->resources.assign(resources.begin(), resources.begin() + numResources);
+
+        published = snapshot;
+        if (current)
+            retiredSnapshots.emplace_back(epochs->retire(), current);
+        trimDirtyLog();
+    }
+
+    // Brings a recycled buffer up to stateVersion, copying only the rows changed since its
+    // version, or every row once the log no longer reaches back that far
+    void refreshSnapshot(Snapshot &snapshot)
+    {
+        if (snapshot.version < dirtyLogBase)
+        {
+            snapshot.state.copyCountersFrom(state);
+            return;
+        }
+
+        for (uint64_t version = snapshot.version + 1; version <= stateVersion; ++version)
+        {
+            int i = dirtyLog[version - dirtyLogBase - 1];
+            if (rowVersion[i] == version)
+                snapshot.state.copyRowFrom(state, i);
+        }
+    }
+
+    // Drops the entries no buffer needs any more. Past one entry per process a full copy
+    // is as cheap, so the log never grows beyond that.
+    void trimDirtyLog()
+    {
+        uint64_t keep = stateVersion - std::min<uint64_t>(stateVersion, state.processes());
+        uint64_t oldest = stateVersion;
+        for (auto &retired : retiredSnapshots)
+            oldest = std::min(oldest, retired.second->version);
+        for (Snapshot *spare : spareSnapshots)
+            oldest = std::min(oldest, spare->version);
+
+        for (keep = std::max(keep, oldest); dirtyLogBase < keep; ++dirtyLogBase)
+            dirtyLog.pop_front();
+    }
+
+    // Records that a grant or release just bumped stateVersion by changing row processId
+    void logRowChange(int processId)
+    {
+        rowVersion[processId] = stateVersion;
+        if (epochs)
+            dirtyLog.push_back(processId);
+    }
+
+    // Sort key of a candidate in the admission pass, smallest first. Starving waiters
+    // come before everyone else, oldest first; the rest follow the policy with aging.
+    tuple<bool, double, uint64_t> admissionRank(const Waiter &waiter, chrono::steady_clock::time_point now) const
+    {
+        auto waited = now - waiter.since;
+        if (waited >= starvationLimit)
+            return make_tuple(false, 0.0, waiter.ticket);
+
+        int aged = static_cast<int>(std::min<decltype(waited.count())>(waited / agingInterval, 64));
+        double key = 0;
+        if (admissionPolicy == AdmissionPolicy::Priority)
+        {
+            key = -(static_cast<double>(waiter.priority) + aged);
+        }
+        else if (admissionPolicy == AdmissionPolicy::ShortestNeedFirst)
+        {
+            for (Counter units : *waiter.request)
+                key += static_cast<double>(units);
+            key = ldexp(key, -aged);
+        }
+        return make_tuple(true, key, waiter.ticket);
+    }
+
+    // Decides one candidate: hands a grant or rejection to the waiter, or parks it again
+    GrantResult admitWaiter(Waiter &waiter)
+    {
+        int blockedBy = -1;
+        GrantResult result = tryGrant(waiter.processId, *waiter.request, &blockedBy);
+
+        if (result == GrantResult::Blocked)
+        {
+            parkWaiter(waiter, blockedBy);
+            return result;
+        }
+
+        waiter.outcome = result;
+        waiter.signalled = true;
+        waiter.wake.notify_one();
+        return result;
+    }
+
+    // Decides the candidates on their behalf, in policy order, and hands each grant
+    // straight to its waiter. Grants made here can unblock further waiters, which
+    // are decided in a following pass. Every candidate is tried: a grant never takes
+    // units out of available, so admitting a later waiter cannot hurt a starving one
+    // that stayed blocked, and often is what makes it safe.
+    void admitWaiters()
+    {
+        while (!candidates.empty())
+        {
+            auto now = chrono::steady_clock::now();
+            vector<pair<tuple<bool, double, uint64_t>, Waiter *>> pass;
+            pass.reserve(candidates.size());
+            for (Waiter *waiter : candidates)
+                pass.emplace_back(admissionRank(*waiter, now), waiter);
+            candidates.clear();
+            sort(pass.begin(), pass.end(), [](const auto &a, const auto &b)
+                 { return a.first < b.first; });
+
+            // Starving waiters lead the pass under every policy
+            size_t k = 0;
+            for (; k < pass.size() && (!get<0>(pass[k].first) || admissionPolicy != AdmissionPolicy::DominantResourceFairness); ++k)
+                admitWaiter(*pass[k].second);
+
+            if (k < pass.size())
+                admitByDominantShare(pass, k);
+        }
+    }
+
+    // The rest of a DRF pass: repeatedly tries the oldest candidate of the tenant with
+    // the smallest dominant share, re-ranking that tenant after each decision
+    template <typename Pass>
+    void admitByDominantShare(const Pass &pass, size_t first)
+    {
+        struct TenantQueue
+        {
+            size_t next = 0;
+            vector<Waiter *> waiters; // oldest first
+        };
+
+        map<int, TenantQueue> queues;
+        for (size_t k = first; k < pass.size(); ++k)
+            queues[tenantOf[pass[k].second->processId]].waiters.push_back(pass[k].second);
+
+        set<pair<double, int>> ready;
+        for (auto &queue : queues)
+            ready.emplace(dominantShare(queue.first), queue.first);
+
+        while (!ready.empty())
+        {
+            int tenant = ready.begin()->second;
+            ready.erase(ready.begin());
+
+            TenantQueue &queue = queues[tenant];
+            admitWaiter(*queue.waiters[queue.next++]);
+            if (queue.next < queue.waiters.size())
+                ready.emplace(dominantShare(tenant), tenant);
+        }
+    }
+
+    double shareOf(Counter units, int j) const
+    {
+        // A resource with no units in the pool cannot be anyone's dominant resource
+        return resources[j] > Counter() ? static_cast<double>(units) / static_cast<double>(resources[j]) : 0;
+    }
+
+    // Recomputed only for tenants that are ranked after resources changed
+    double dominantShare(int t)
+    {
+        Tenant &tenant = tenants[t];
+        if (tenant.shareVersion != resourcesVersion)
+        {
+            tenant.share = 0;
+            for (size_t j = 0; j < state.resourceTypes(); ++j)
+                tenant.share = std::max(tenant.share, shareOf(tenant.allocation[j], j));
+            tenant.shareVersion = resourcesVersion;
+        }
+        return tenant.share;
+    }
+
+    // A grant only raises the tenant's fractions of the granted resources
+    void chargeTenant(int processId, const vector<Counter> &units)
+    {
+        Tenant &tenant = tenants[tenantOf[processId]];
+        bool fresh = tenant.shareVersion == resourcesVersion;
+        for (size_t j = 0; j < units.size(); ++j)
+        {
+            if (units[j] == Counter())
+                continue;
+            tenant.allocation[j] += units[j];
+            if (fresh)
+                tenant.share = std::max(tenant.share, shareOf(tenant.allocation[j], j));
+        }
+    }
+
+    // Releases also grow resources, so the caller bumps resourcesVersion after this
+    void creditTenant(int processId, const vector<Counter> &units)
+    {
+        Tenant &tenant = tenants[tenantOf[processId]];
+        for (size_t j = 0; j < units.size(); ++j)
+            tenant.allocation[j] -= units[j];
+    }
+
+    // Moves the holdings of one process to another tenant; both shares are recomputed when next ranked
+    void moveTenant(int processId, int tenant)
+    {
+        if (static_cast<size_t>(tenant) >= tenants.size())
+            tenants.resize(tenant + 1, Tenant(state.makeRow({})));
+
+        Tenant &from = tenants[tenantOf[processId]];
+        Tenant &to = tenants[tenant];
+        for (size_t j = 0; j < state.resourceTypes(); ++j)
+        {
+            Counter held = state.allocationAt(processId, j);
+            from.allocation[j] -= held;
+            to.allocation[j] += held;
+        }
+        from.shareVersion = 0;
+        to.shareVersion = 0;
+    }
+
+    void rebuildTenants()
+    {
+        tenants.clear();
+        if (admissionPolicy != AdmissionPolicy::DominantResourceFairness)
+            return;
+
+        int numTenants = *max_element(tenantOf.begin(), tenantOf.end()) + 1;
+        tenants.assign(numTenants, Tenant(state.makeRow({})));
+        for (size_t i = 0; i < state.processes(); ++i)
+        {
+            for (size_t j = 0; j < state.resourceTypes(); ++j)
+                tenants[tenantOf[i]].allocation[j] += state.allocationAt(i, j);
+        }
+    }
+
+    // Parks the caller until the request is granted or can never be. wait(waiter)
+    // sleeps until an admission pass decides the waiter and returns false if the
+    // caller gave up first.
+    template <typename Wait>
+    bool waitForGrant(int processId, const vector<Counter> &request, int priority, Wait wait)
+    {
+        int blockedBy = -1;
+        GrantResult result = tryGrant(processId, request, &blockedBy);
+
+        if (result == GrantResult::Blocked)
+        {
+            Waiter self(processId, request, priority, nextTicket++);
+            parkWaiter(self, blockedBy);
+
+            if (wait(self))
+            {
+                result = self.outcome;
+            }
+            else
+            {
+                unparkWaiter(self);
+                result = tryGrant(processId, request);
+            }
+        }
+
+        admitWaiters();
+        publishSnapshot();
+        return result == GrantResult::Granted;
+    }
+
+    // Grants the request if it is safe to; the caller holds mtx. When the request is
+    // blocked by an unsafe state, blockedBy receives the component that failed.
+    GrantResult tryGrant(int processId, const vector<Counter> &request, int *blockedBy = nullptr)
+    {
+        GrantResult screened = screenRequest(processId, request);
+        if (screened != GrantResult::Granted)
+            return screened;
+
+        int c = componentOf[processId];
+
+        int knownBlocker = recallUnsafe(processId, request);
+        if (knownBlocker >= 0)
+        {
+            if (blockedBy)
+                *blockedBy = knownBlocker;
+            return GrantResult::Blocked;
+        }
+
+        if (recallSafe(processId, request))
+        {
+            // Some order works after this grant, though not necessarily the remembered one
+            state.grant(processId, request);
+            components[c].envelopesFresh = false;
+            components[c].orderStale = true;
+        }
+        else if (withinEnvelope(processId, request))
+        {
+            // Known safe: the remembered order still works after this grant
+            state.grant(processId, request);
+        }
+        else
+        {
+            // Cyclic workloads keep coming back to the same states, so verdicts are cached
+            // by the hash of the state the check runs on
+            uint64_t key = hashAfterGrant(processId, request);
+            int unsafe;
+
+            // Tentatively grant the request on the live state; the lock is held, so nobody else observes it
+            state.grant(processId, request);
+
+            if (const CachedVerdict *cached = recallVerdict(key))
+            {
+                unsafe = cached->blocker;
+                if (unsafe < 0 && cached->component == c)
+                {
+                    components[c].safeSequence = cached->sequence;
+                    components[c].envelopesFresh = false;
+                    components[c].orderStale = false;
+                }
+                else if (unsafe < 0)
+                {
+                    // Safe, but the cached order belongs to another component
+                    components[c].envelopesFresh = false;
+                    components[c].orderStale = true;
+                }
+            }
+            else
+            {
+                for (size_t i = 0; i < request.size(); ++i)
+                {
+                    available[i] -= request[i];
+                }
+
+                // Check if the state is safe. The request only touches resources of this
+                // process's component, so the other components keep whatever verdict they had.
+                unsafe = firstUnsafeComponent(c);
+                if (unsafe < 0 && !checkSafety(c))
+                    unsafe = c;
+
+                // Add the resources back to available, after the process has completed or on rollback
+                for (size_t i = 0; i < request.size(); ++i)
+                {
+                    available[i] += request[i];
+                }
+
+                rememberVerdict(key, unsafe, c);
+            }
+            bool safeState = unsafe < 0;
+
+            if (!safeState)
+            {
+                // Roll the tentative grant back
+                state.revoke(processId, request);
+                rememberUnsafe(processId, request, unsafe);
+                if (blockedBy)
+                    *blockedBy = unsafe;
+                return GrantResult::Blocked;
+            }
+            rememberSafe(processId, request);
+        }
+
+        commitGrant(processId, request);
+        return GrantResult::Granted;
+    }
+
+    static uint64_t splitmix64(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // Zobrist key of one cell holding one value. Cells are numbered row-major over
+    // allocation, then over available; zero contributes nothing, so empty cells are free.
+    static uint64_t zobrist(uint64_t cell, Counter value)
+    {
+        return value == Counter() ? 0 : splitmix64(splitmix64(cell) ^ static_cast<uint64_t>(value));
+    }
+
+    uint64_t allocationCell(int i, int j) const { return uint64_t(i) * state.resourceTypes() + j; }
+    uint64_t availableCell(int j) const { return uint64_t(state.processes()) * state.resourceTypes() + j; }
+
+    // stateHash as it would be with the request granted and taken out of available,
+    // which is the state the safety check runs on
+    uint64_t hashAfterGrant(int processId, const vector<Counter> &request) const
+    {
+        uint64_t hash = stateHash;
+        for (size_t j = 0; j < request.size(); ++j)
+        {
+            if (request[j] == Counter())
+                continue;
+            Counter held = state.allocationAt(processId, j);
+            hash ^= zobrist(allocationCell(processId, j), held) ^ zobrist(allocationCell(processId, j), held + request[j]);
+            hash ^= zobrist(availableCell(j), available[j]) ^ zobrist(availableCell(j), available[j] - request[j]);
+        }
+        return hash;
+    }
+
+    // Counts the lookup as a hit or a miss
+    const CachedVerdict *recallVerdict(uint64_t key)
+    {
+        auto cached = safetyCache.find(key);
+        if (cached == safetyCache.end())
+        {
+            safetyCacheMisses++;
+            return nullptr;
+        }
+        safetyCacheHits++;
+        return &cached->second;
+    }
+
+    // Bounded: once full, the oldest entry makes room
+    void rememberVerdict(uint64_t key, int blocker, int c)
+    {
+        if (safetyCacheCapacity == 0)
+            return;
+
+        auto inserted = safetyCache.emplace(key, CachedVerdict());
+        if (inserted.second)
+        {
+            if (safetyCacheKeys.size() < safetyCacheCapacity)
+            {
+                safetyCacheKeys.push_back(key);
+            }
+            else
+            {
+                safetyCache.erase(safetyCacheKeys[safetyCacheNext]);
+                safetyCacheKeys[safetyCacheNext] = key;
+                safetyCacheNext = (safetyCacheNext + 1) % safetyCacheCapacity;
+            }
+        }
+
+        CachedVerdict &verdict = inserted.first->second;
+        verdict.blocker = blocker;
+        verdict.component = c;
+        if (blocker < 0)
+            verdict.sequence = components[c].safeSequence;
+        else
+            verdict.sequence.clear();
+    }
+
+    static bool dominates(const vector<Counter> &larger, const vector<Counter> &smaller)
+    {
+        if (larger.size() != smaller.size())
+            return false;
+        for (size_t j = 0; j < larger.size(); ++j)
+        {
+            if (larger[j] < smaller[j])
+                return false;
+        }
+        return true;
+    }
+
+    // Verdicts are monotone in the request: below a request that was safe is safe, and
+    // above one that was unsafe is unsafe. A safe verdict even survives every later
+    // change, since neither a grant (which lowers a need without taking anything out
+    // of available) nor a release keeps any order from working. An unsafe verdict
+    // only holds in the state it was reached in.
+    bool recallSafe(int processId, const vector<Counter> &request) const
+    {
+        for (auto &known : verdicts[processId].safe)
+        {
+            if (dominates(known, request))
+                return true;
+        }
+        return false;
+    }
+
+    // The component that blocked a request at or below this one in the current state, or -1
+    int recallUnsafe(int processId, const vector<Counter> &request) const
+    {
+        const Verdicts &memo = verdicts[processId];
+        if (memo.unsafeVersion != stateVersion)
+            return -1;
+        for (auto &known : memo.unsafe)
+        {
+            if (dominates(request, known.first))
+                return known.second;
+        }
+        return -1;
+    }
+
+    // Keeps only the frontier: a new entry replaces those it covers, and the oldest
+    // goes when the memo is full
+    void rememberSafe(int processId, const vector<Counter> &request)
+    {
+        auto &safe = verdicts[processId].safe;
+        safe.erase(remove_if(safe.begin(), safe.end(), [&](const vector<Counter> &known)
+                             { return dominates(request, known); }),
+                   safe.end());
+        if (safe.size() == verdictsPerProcess)
+            safe.erase(safe.begin());
+        safe.push_back(request);
+    }
+
+    void rememberUnsafe(int processId, const vector<Counter> &request, int blocker)
+    {
+        Verdicts &memo = verdicts[processId];
+        if (memo.unsafeVersion != stateVersion)
+        {
+            memo.unsafe.clear();
+            memo.unsafeVersion = stateVersion;
+        }
+        memo.unsafe.erase(remove_if(memo.unsafe.begin(), memo.unsafe.end(), [&](const pair<vector<Counter>, int> &known)
+                                    { return dominates(known.first, request); }),
+                          memo.unsafe.end());
+        if (memo.unsafe.size() == verdictsPerProcess)
+            memo.unsafe.erase(memo.unsafe.begin());
+        memo.unsafe.emplace_back(request, blocker);
+    }
+
+    // The checks before the safety check: Granted when only safety is left to decide
+    GrantResult screenRequest(int processId, const vector<Counter> &request) const
+    {
+        // Check that the request is within max claim and that the grant cannot overflow
+        // the counters once the units are handed back; neither gets better by waiting
+        if (request.size() > state.resourceTypes())
+            return GrantResult::Rejected;
+        for (size_t i = 0; i < request.size(); ++i)
+        {
+            if (request[i] < Counter() || request[i] > state.needAt(processId, i) ||
+                sumOverflows(inCirculation[i], request[i]))
+            {
+                return GrantResult::Rejected;
+            }
+        }
+
+        // Check if the requested resources are available
+        for (size_t i = 0; i < request.size(); ++i)
+        {
+            if (request[i] > available[i])
+            {
+                return GrantResult::Blocked;
+            }
+        }
+
+        return GrantResult::Granted;
+    }
+
+    // Bookkeeping for a grant already applied to state and known to be safe
+    void commitGrant(int processId, const vector<Counter> &request)
+    {
+        int c = componentOf[processId];
+
+        for (size_t j = 0; j < request.size(); ++j)
+        {
+            if (request[j] == Counter())
+                continue;
+            Counter held = state.allocationAt(processId, j);
+            stateHash ^= zobrist(allocationCell(processId, j), held - request[j]) ^ zobrist(allocationCell(processId, j), held);
+        }
+
+        completed[processId] = true;
+        markHolds(c);
+        for (size_t i = 0; i < request.size(); ++i)
+        {
+            inCirculation[i] += request[i];
+        }
+        if (!tenants.empty())
+            chargeTenant(processId, request);
+        stateVersion++;
+        grantVersion++;
+        logRowChange(processId);
 
-public:
-    BankersAlgorithm(const vector<vector<int>> &allocation, const vector<vector<int>> &max,
-                     const vector<int> &available) : allocation(allocation), max(max), available(available)
+        // The grant only lowered this process's need; its other envelope bounds still hold
+        if (components[c].envelopesFresh)
+        {
+            state.forEachClaim(processId, [&](int, size_t cell, Counter need)
+                               { envelopes[cell] = std::min(envelopes[cell], need); });
+        }
+
+        // A grant lowers this process's need without taking units out of available,
+        // which can make the component safe for a request that was blocked on it
+        wakeSafetyWaiters(c);
+    }
+
+    // Runs the safety check for a request on a private copy of the state with mtx
+    // released, then validates and commits under mtx. Clears decided when the request
+    // is left to the locked path.
+    GrantResult tryGrantOptimistic(int processId, const vector<Counter> &request, bool &decided)
     {
-        int numProcesses = allocation.size();
-        int numResources = allocation[0].size();
-        completed.resize(numProcesses, false);
-        resources.resize(numResources, 0);
+        decided = false;
+        int c = componentOf[processId];
+        const Component &component = components[c]; // processes and resources never change
 
-        for (int i = 0; i < numProcesses; ++i)
+        struct Lease
         {
-            for (int j = 0; j < numResources; ++j)
+            BasicBankersAlgorithm &banker;
+            unique_ptr<SearchBuffer> buffer;
+            ~Lease()
+            {
+                if (!buffer)
+                    return;
+                lock_guard<mutex> lock(banker.searchBuffersMtx);
+                banker.searchBuffers.push_back(std::move(buffer));
+            }
+        } lease{*this, nullptr};
+        {
+            lock_guard<mutex> lock(searchBuffersMtx);
+            if (!searchBuffers.empty())
+            {
+                lease.buffer = std::move(searchBuffers.back());
+                searchBuffers.pop_back();
+            }
+        }
+
+        for (int attempt = 0; attempt < optimisticRetries; ++attempt)
+        {
+            uint64_t seenGrants, seenState;
+            SafetySettings settings;
+            {
+                shared_lock<shared_mutex> lock(mtx);
+
+                // The locked path is as cheap when the envelope covers the request
+                if (componentsNotHolding > 0 || screenRequest(processId, request) != GrantResult::Granted ||
+                    (components[c].envelopesFresh && envelopeCovers(processId, request)))
+                {
+                    return GrantResult::Blocked;
+                }
+
+                seenGrants = grantVersion;
+                seenState = stateVersion;
+                settings = safetySettings();
+
+                if (!lease.buffer)
+                    lease.buffer.reset(new SearchBuffer(state, rowVersion));
+                SearchBuffer &buffer = *lease.buffer;
+                for (int i : component.processes)
+                {
+                    if (buffer.rowVersion[i] != rowVersion[i])
+                    {
+                        buffer.state.copyRowFrom(state, i);
+                        buffer.rowVersion[i] = rowVersion[i];
+                    }
+                }
+                buffer.work = available;
+                buffer.order = components[c].safeSequence;
+            }
+
+            SearchBuffer &buffer = *lease.buffer;
+            buffer.state.grant(processId, request);
+            for (size_t i = 0; i < request.size(); ++i)
+                buffer.work[i] -= request[i];
+
+            // Replay the remembered order first, as checkSafety does
+            bool replayed = replayOrder(buffer.state, buffer.work, component, buffer.order);
+
+            vector<int> &sequence = buffer.sequence;
+            bool safe = replayed || runSafetyAlgorithm(buffer.state, buffer.work, component, sequence, settings);
+            buffer.state.revoke(processId, request); // the buffer mirrors state again
+
+            unique_lock<shared_mutex> lock(mtx);
+            if (!safe && stateVersion == seenState)
             {
-                resources[j] += allocation[i][j];
+                decided = true;
+                return GrantResult::Blocked;
             }
+            if (!safe || grantVersion != seenGrants || screenRequest(processId, request) != GrantResult::Granted)
+                continue;
+
+            state.grant(processId, request);
+            if (!replayed)
+            {
+                swap(components[c].safeSequence, sequence);
+                components[c].envelopesFresh = false;
+                components[c].orderStale = false;
+            }
+            commitGrant(processId, request);
+            admitWaiters();
+            publishSnapshot();
+            decided = true;
+            return GrantResult::Granted;
         }
+
+        return GrantResult::Blocked;
     }
 
-    bool requestResources(int processId, const vector<int> &request)
+    // The release itself; the caller holds mtx and runs the admission pass afterwards
+    bool applyRelease(int processId, const vector<Counter> &release)
     {
-        unique_lock<mutex> lock(mtx);
-
-        // Check if the requested resources are available and within max claim
-        for (int i = 0; i < request.size(); ++i)
+        // A process can only release what it holds, and the running totals must stay representable
+        if (release.size() > state.resourceTypes())
+            return false;
+        for (size_t i = 0; i < release.size(); ++i)
         {
-            if (request[i] > max[processId][i] - allocation[processId][i] || request[i] > available[i])
+            if (release[i] < Counter() || release[i] > state.allocationAt(processId, i) ||
+                sumOverflows(resources[i], release[i]))
             {
                 return false;
             }
         }
 
-        // Temporarily allocate the requested resources
-        vector<vector<int>> tempAllocation = allocation;
-        vector<int> tempAvailable = available;
-        vector<int> tempResources = resources;
+        // Release the resources. Returned units are added to available and to the
+        // releasing process's need alike, so every process in a safe order still
+        // fits when its turn comes: the state stays safe without a search, the
+        // remembered order stays valid and the envelopes derived from it only widen.
+        state.revoke(processId, release);
+        for (size_t i = 0; i < release.size(); ++i)
+        {
+            available[i] += release[i];
+            resources[i] += release[i];
+        }
+
+        for (size_t j = 0; j < release.size(); ++j)
+        {
+            if (release[j] == Counter())
+                continue;
+            Counter held = state.allocationAt(processId, j);
+            stateHash ^= zobrist(allocationCell(processId, j), held + release[j]) ^ zobrist(allocationCell(processId, j), held);
+            stateHash ^= zobrist(availableCell(j), available[j] - release[j]) ^ zobrist(availableCell(j), available[j]);
+        }
+
+        completed[processId] = false;
+
+        if (!tenants.empty())
+            creditTenant(processId, release);
+        resourcesVersion++;
+        stateVersion++;
+        logRowChange(processId);
+
+        // Consider only the waiters this release can help: those whose last deficit it
+        // covers, and those blocked on the safety of this process's component. This
+        // runs under mtx, since a waiter that times out destroys its condition variable.
+        for (size_t i = 0; i < release.size(); ++i)
+        {
+            if (release[i] != Counter())
+                wakeDeficitWaiters(i);
+        }
+        wakeSafetyWaiters(componentOf[processId]);
+
+        return true;
+    }
+
+    // Several requests can be granted tentatively at once: each one is screened
+    // against what the earlier ones took out of available, and safety is checked on
+    // the combined state. Returns false, changing nothing, if the screen fails.
+    bool grantTentatively(int processId, const vector<Counter> &request)
+    {
+        if (screenRequest(processId, request) != GrantResult::Granted)
+            return false;
 
-        // Update temporary vectors with the requested resources
-        for (int i = 0; i < request.size(); ++i)
+        state.grant(processId, request);
+        for (size_t i = 0; i < request.size(); ++i)
         {
-            tempAllocation[processId][i] += request[i];
-            tempAvailable[i] -= request[i];
-            tempResources[i] -= request[i];
+            available[i] -= request[i];
+            inCirculation[i] += request[i];
         }
+        return true;
+    }
 
-        // Create a temporary BankersAlgorithm object with the updated allocation and available resources
-        BankersAlgorithm tempBanker(tempAllocation, max, tempAvailable);
+    void revokeTentative(int processId, const vector<Counter> &request)
+    {
+        state.revoke(processId, request);
+        for (size_t i = 0; i < request.size(); ++i)
+        {
+            available[i] += request[i];
+            inCirculation[i] -= request[i];
+        }
+    }
 
-        // Check if the state is safe
-        bool safeState = tempBanker.isSafeState();
+    // Turns a tentative grant whose combined state was found safe into a real one
+    void commitTentative(int processId, const vector<Counter> &request)
+    {
+        for (size_t i = 0; i < request.size(); ++i)
+        {
+            available[i] += request[i];
+            inCirculation[i] -= request[i];
+        }
+        commitGrant(processId, request);
+    }
 
-        if (safeState)
+    // Checks the components of every tentative grant so far. The other components
+    // are untouched, so they keep the verdict they had.
+    bool tentativeStateSafe(vector<int> touched)
+    {
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for (int c : touched)
         {
-            allocation = tempAllocation;
-            available = tempAvailable;
-            resources = tempResources;
-            completed[processId] = true;
+            if (!checkSafety(c))
+                return false;
+        }
+        return true;
+    }
 
-            // Add the resources back to available and resources after the process has completed
-            for (int i = 0; i < request.size(); ++i)
+    // Grants a combined batch of requests. All of them are applied tentatively and
+    // each component they touch is checked once; only if that fails is every request
+    // decided on its own, in submission order.
+    void grantCombined(const vector<CombiningSlot *> &requests)
+    {
+        vector<CombiningSlot *> tentative;
+        vector<int> touched;
+        if (requests.size() > 1 && componentsNotHolding == 0)
+        {
+            for (CombiningSlot *slot : requests)
             {
-                available[i] += request[i];
-                resources[i] += request[i];
+                if (grantTentatively(slot->processId, *slot->units))
+                {
+                    tentative.push_back(slot);
+                    touched.push_back(componentOf[slot->processId]);
+                }
             }
+        }
 
-            return true;
+        bool safe = !tentative.empty() && tentativeStateSafe(touched);
+        if (safe)
+        {
+            for (CombiningSlot *slot : tentative)
+            {
+                commitTentative(slot->processId, *slot->units);
+                slot->result = true;
+            }
         }
         else
         {
-            return false;
+            for (auto slot = tentative.rbegin(); slot != tentative.rend(); ++slot)
+                revokeTentative((*slot)->processId, *(*slot)->units);
+        }
+
+        for (CombiningSlot *slot : requests)
+        {
+            if (!safe || find(tentative.begin(), tentative.end(), slot) == tentative.end())
+                slot->result = tryGrant(slot->processId, *slot->units) == GrantResult::Granted;
+            slot->phase.store(CombiningSlot::Done);
         }
     }
 
-    void releaseResources(int processId, const vector<int> &release)
+    // Applies every published operation in one hold of mtx. Releases go first, since
+    // they can only help the requests in the same batch.
+    void combinePending()
     {
-        unique_lock<mutex> lock(mtx);
-
-        // Release the resources
-        for (int i = 0; i < release.size(); ++i)
+        vector<CombiningSlot *> requests;
+        for (CombiningSlot &slot : combiningSlots)
         {
-            allocation[processId][i] -= release[i];
-            available[i] += release[i];
-            resources[i] += release[i];
+            if (slot.phase.load() != CombiningSlot::Pending)
+                continue;
+
+            if (slot.release)
+            {
+                slot.result = applyRelease(slot.processId, *slot.units);
+                slot.phase.store(CombiningSlot::Done);
+            }
+            else
+            {
+                requests.push_back(&slot);
+            }
         }
 
-        completed[processId] = false;
-        cv.notify_all();
+        grantCombined(requests);
+        admitWaiters();
+        publishSnapshot();
     }
 
-    bool isSafeState()
+    // Publishes the operation in a slot and waits for whichever thread takes mtx to apply it
+    bool submitCombined(bool release, int processId, const vector<Counter> &units)
     {
-        int numProcesses = allocation.size();
-        int numResources = allocation[0].size();
+        CombiningSlot *slot = nullptr;
+        for (size_t k = hash<thread::id>()(this_thread::get_id()); !slot; ++k)
+        {
+            CombiningSlot &candidate = combiningSlots[k % combiningSlots.size()];
+            int free = CombiningSlot::Free;
+            if (candidate.phase.compare_exchange_strong(free, CombiningSlot::Filling))
+                slot = &candidate;
+        }
 
-        vector<bool> safe(numProcesses, false);
-        vector<vector<int>> need(numProcesses, vector<int>(numResources, 0));
-        vector<int> work = available;
+        slot->release = release;
+        slot->processId = processId;
+        slot->units = &units;
+        slot->phase.store(CombiningSlot::Pending);
+
+        while (slot->phase.load() != CombiningSlot::Done)
+        {
+            unique_lock<shared_mutex> lock(mtx, try_to_lock);
+            if (lock.owns_lock())
+                combinePending();
+            else
+                this_thread::yield();
+        }
+
+        bool result = slot->result;
+        slot->phase.store(CombiningSlot::Free);
+        return result;
+    }
+
+public:
+    BasicBankersAlgorithm(const vector<vector<Counter>> &allocation, const vector<vector<Counter>> &max,
+                          const vector<Counter> &available)
+        : state(allocation, max), available(state.makeRow(available)), resources(state.makeRow({})),
+          inCirculation(state.makeRow(available))
+    {
+        int numProcesses = state.processes();
+        int numResources = state.resourceTypes();
+        completed.resize(numProcesses, false);
+        envelopes.resize(state.cells());
 
-        // Calculate the need matrix
         for (int i = 0; i < numProcesses; ++i)
         {
             for (int j = 0; j < numResources; ++j)
             {
-                need[i][j] = max[i][j] - allocation[i][j];
+                resources[j] += state.allocationAt(i, j);
+                inCirculation[j] += state.allocationAt(i, j);
             }
         }
 
-        bool finished;
-        int count = 0;
+        verdicts.resize(numProcesses);
+        rowVersion.resize(numProcesses);
+        tenantOf.resize(numProcesses);
+        iota(tenantOf.begin(), tenantOf.end(), 0);
 
-        do
+        for (int i = 0; i < numProcesses; ++i)
         {
-            finished = true;
+            for (int j = 0; j < numResources; ++j)
+                stateHash ^= zobrist(allocationCell(i, j), state.allocationAt(i, j));
+        }
+        for (int j = 0; j < numResources; ++j)
+            stateHash ^= zobrist(availableCell(j), this->available[j]);
+
+        findComponents();
+        deficitWaiters.resize(numResources);
+        safetyWaiters.resize(components.size());
+    }
+
+    bool requestResources(int processId, const vector<Counter> &request)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        bool granted = tryGrant(processId, request) == GrantResult::Granted;
+        admitWaiters();
+        publishSnapshot();
+        return granted;
+    }
+
+    // As requestResources, but the safety check runs on a copy of the state without
+    // holding mtx, so checks for different requests overlap. Falls back to the locked
+    // path when the copy keeps going stale or the quick envelope check applies.
+    bool requestResourcesOptimistic(int processId, const vector<Counter> &request)
+    {
+        bool decided;
+        GrantResult result = tryGrantOptimistic(processId, request, decided);
+        if (decided)
+            return result == GrantResult::Granted;
+        return requestResources(processId, request);
+    }
+
+    // Blocks until the request can be granted safely. A request that can never be
+    // granted, such as one beyond the process's max claim, fails straight away.
+    // priority only matters under AdmissionPolicy::Priority.
+    bool acquireResources(int processId, const vector<Counter> &request, int priority = 0)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+
+        auto wait = [&](Waiter &self)
+        {
+            self.wake.wait(lock, [&]
+                           { return self.signalled; });
+            return true;
+        };
+        return waitForGrant(processId, request, priority, wait);
+    }
+
+    // As acquireResources, but gives up and returns false once the deadline passes
+    template <typename Clock, typename Duration>
+    bool acquireResourcesUntil(int processId, const vector<Counter> &request,
+                               const chrono::time_point<Clock, Duration> &deadline, int priority = 0)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+
+        auto wait = [&](Waiter &self)
+        {
+            return self.wake.wait_until(lock, deadline, [&]
+                                        { return self.signalled; });
+        };
+        return waitForGrant(processId, request, priority, wait);
+    }
 
-            for (int i = 0; i < numProcesses; ++i)
+    template <typename Rep, typename Period>
+    bool acquireResourcesFor(int processId, const vector<Counter> &request, const chrono::duration<Rep, Period> &timeout,
+                             int priority = 0)
+    {
+        return acquireResourcesUntil(processId, request, chrono::steady_clock::now() + timeout, priority);
+    }
+
+    bool releaseResources(int processId, const vector<Counter> &release)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        bool released = applyRelease(processId, release);
+        admitWaiters();
+        publishSnapshot();
+        return released;
+    }
+
+    // Decides a burst of (processId, request) pairs in one hold of mtx, with safety
+    // evaluated on the combined state rather than once per request from scratch.
+    // Only the requests' own components are rechecked, and each check starts from
+    // the remembered order. Combining is conservative: a request is only granted if
+    // it is safe together with the others granted in the batch.
+    vector<bool> requestResourcesBatch(const vector<pair<int, vector<Counter>>> &batch,
+                                       BatchAdmission admission = BatchAdmission::LargestPrefix)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        vector<bool> granted(batch.size(), false);
+
+        // Combined checks cover only the batch's components, so the rest must be known safe
+        bool fallback = firstUnsafeComponent(-1) >= 0;
+        if (fallback)
+        {
+            for (size_t k = 0; k < batch.size(); ++k)
+                granted[k] = tryGrant(batch[k].first, batch[k].second) == GrantResult::Granted;
+        }
+        else if (admission == BatchAdmission::Greedy)
+        {
+            // A request only touches its own component, so that is the one to check
+            for (size_t k = 0; k < batch.size(); ++k)
             {
-                if (safe[i])
+                int processId = batch[k].first;
+                if (!grantTentatively(processId, batch[k].second))
                     continue;
+                if (checkSafety(componentOf[processId]))
+                    granted[k] = true;
+                else
+                    revokeTentative(processId, batch[k].second);
+            }
+        }
+        else
+        {
+            // Everything up to the first request that fails the screen is a candidate.
+            // Dropping a grant from a safe combined state keeps it safe, so prefix
+            // safety is monotone and the largest safe prefix can be bisected.
+            vector<int> touched;
+            size_t applied = 0;
+            while (applied < batch.size() && grantTentatively(batch[applied].first, batch[applied].second))
+                touched.push_back(componentOf[batch[applied++].first]);
 
-                bool canExecute = true;
+            size_t safePrefix = 0, unsafePrefix = applied + 1;
+            if (applied > 0 && tentativeStateSafe(touched))
+                safePrefix = applied;
+            else
+                unsafePrefix = applied;
 
-                for (int j = 0; j < numResources; ++j)
-                {
-                    if (need[i][j] > work[j])
-                    {
-                        canExecute = false;
-                        break;
-                    }
-                }
+            while (unsafePrefix - safePrefix > 1)
+            {
+                size_t mid = safePrefix + (unsafePrefix - safePrefix) / 2;
+                for (; applied > mid; --applied)
+                    revokeTentative(batch[applied - 1].first, batch[applied - 1].second);
+                for (; applied < mid; ++applied)
+                    grantTentatively(batch[applied].first, batch[applied].second);
 
-                if (canExecute)
-                {
-                    safe[i] = true;
-                    for (int j = 0; j < numResources; ++j)
-                    {
-                        work[j] += allocation[i][j];
-                    }
-                    finished = false;
-                    count++;
-                }
+                touched.resize(mid);
+                if (tentativeStateSafe(touched))
+                    safePrefix = mid;
+                else
+                    unsafePrefix = mid;
             }
-        } while (!finished && count < numProcesses);
 
-        if (count < numProcesses)
+            for (; applied > safePrefix; --applied)
+                revokeTentative(batch[applied - 1].first, batch[applied - 1].second);
+            for (; applied < safePrefix; ++applied)
+                grantTentatively(batch[applied].first, batch[applied].second);
+            fill(granted.begin(), granted.begin() + safePrefix, true);
+        }
+
+        if (!fallback)
         {
-            return false; // Deadlock detected
+            for (size_t k = 0; k < batch.size(); ++k)
+            {
+                if (granted[k])
+                    commitTentative(batch[k].first, batch[k].second);
+            }
         }
 
-        for (bool isSafe : safe)
+        admitWaiters();
+        publishSnapshot();
+        return granted;
+    }
+
+    // For each (processId, request) candidate, whether requestResources would grant it
+    // now, without granting anything. All candidates are answered against the same
+    // state under the shared lock. The envelopes of their components are computed
+    // once, which answers most candidates in O(m); the rest are replayed against the
+    // remembered order and searched on private copies of the state, spread over the
+    // thread pool (SafetyAlgorithm::Parallel) when there are many of them.
+    vector<bool> wouldGrant(const vector<pair<int, vector<Counter>>> &candidates)
+    {
+        // Every other component has to be known safe. Settling that caches verdicts,
+        // which needs mtx exclusively, but happens at most once per component.
+        bool settled;
         {
-            if (!isSafe)
-                return false;
+            shared_lock<shared_mutex> lock(mtx);
+            settled = componentsNotHolding == 0;
+        }
+        if (!settled)
+        {
+            unique_lock<shared_mutex> lock(mtx);
+            if (firstUnsafeComponent(-1) >= 0)
+                return vector<bool>(candidates.size(), false);
+        }
+
+        shared_lock<shared_mutex> lock(mtx);
+        vector<char> granted(candidates.size(), 0); // not vector<bool>, pool tasks write it concurrently
+
+        // Envelopes of the candidates' components, computed into a copy where stale.
+        // A component whose order may no longer work has no usable envelopes.
+        vector<int> stale;
+        for (auto &candidate : candidates)
+        {
+            int c = componentOf[candidate.first];
+            if (!components[c].envelopesFresh && !components[c].orderStale)
+                stale.push_back(c);
+        }
+        sort(stale.begin(), stale.end());
+        stale.erase(unique(stale.begin(), stale.end()), stale.end());
+
+        vector<Counter> staleBounds;
+        if (!stale.empty())
+        {
+            staleBounds = envelopes;
+            for (int c : stale)
+                computeEnvelopes(components[c], staleBounds);
+        }
+        const vector<Counter> &bounds = stale.empty() ? envelopes : staleBounds;
+
+        vector<size_t> searched;
+        for (size_t k = 0; k < candidates.size(); ++k)
+        {
+            int processId = candidates[k].first;
+            const vector<Counter> &request = candidates[k].second;
+            if (screenRequest(processId, request) != GrantResult::Granted)
+                continue;
+            if (!components[componentOf[processId]].orderStale && envelopeCovers(processId, request, bounds))
+                granted[k] = 1;
+            else
+                searched.push_back(k);
         }
 
+        // Each partition works on its own copy of the state, granting and revoking every
+        // candidate in turn. Pool tasks cannot submit to the pool, so Parallel scans serially.
+        size_t partitions = 1;
+        if (pool && searched.size() >= parallelCandidates)
+            partitions = std::min(pool->concurrency(), searched.size());
+        size_t perPartition = (searched.size() + partitions - 1) / std::max<size_t>(partitions, 1);
+
+        function<void(size_t)> searchPartition = [&](size_t part)
+        {
+            size_t begin = part * perPartition;
+            size_t end = std::min(searched.size(), begin + perPartition);
+            if (begin >= end)
+                return;
+
+            Storage copy = state;
+            vector<int> sequence;
+            for (size_t s = begin; s < end; ++s)
+            {
+                int processId = candidates[searched[s]].first;
+                const vector<Counter> &request = candidates[searched[s]].second;
+                const Component &component = components[componentOf[processId]];
+
+                copy.grant(processId, request);
+                Row work = available;
+                for (size_t i = 0; i < request.size(); ++i)
+                    work[i] -= request[i];
+
+                bool safe = replayOrder(copy, work, component, component.safeSequence);
+                if (!safe && safetyAlgorithm == SafetyAlgorithm::Indexed)
+                    safe = isSafeStateIndexed(copy, work, component, sequence);
+                else if (!safe)
+                    safe = isSafeStateScan(copy, work, component, sequence);
+
+                granted[searched[s]] = safe;
+                copy.revoke(processId, request);
+            }
+        };
+
+        if (partitions > 1)
+            pool->parallelFor(partitions, searchPartition);
+        else if (!searched.empty())
+            searchPartition(0);
+
+        return vector<bool>(granted.begin(), granted.end());
+    }
+
+    // As requestResources, through the flat-combining front end
+    bool requestResourcesCombined(int processId, const vector<Counter> &request)
+    {
+        return submitCombined(false, processId, request);
+    }
+
+    // As releaseResources, through the flat-combining front end
+    bool releaseResourcesCombined(int processId, const vector<Counter> &release)
+    {
+        return submitCombined(true, processId, release);
+    }
+
+    void setSafetyAlgorithm(SafetyAlgorithm algorithm)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+
+        // The pool exists before any search can see Parallel selected
+        if (algorithm == SafetyAlgorithm::Parallel && !pool)
+            pool.reset(new ThreadPool(std::max(1u, thread::hardware_concurrency()) - 1));
+        safetyAlgorithm = algorithm;
+    }
+
+    // Ordering of blocked waiters. Each agingInterval waited moves a waiter up as
+    // described on AdmissionPolicy; past starvationLimit it is tried before anyone else.
+    void setAdmissionPolicy(AdmissionPolicy policy,
+                            chrono::steady_clock::duration aging = chrono::milliseconds(100),
+                            chrono::steady_clock::duration starvation = chrono::seconds(1))
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        admissionPolicy = policy;
+        agingInterval = std::max(aging, chrono::steady_clock::duration(1));
+        starvationLimit = starvation;
+        rebuildTenants();
+    }
+
+    // Groups processes for DominantResourceFairness; each process starts as its own tenant.
+    // Returns false, changing nothing, for a negative tenant.
+    bool setTenant(int processId, int tenant)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        if (tenant < 0)
+            return false;
+
+        if (!tenants.empty())
+            moveTenant(processId, tenant);
+        tenantOf[processId] = tenant;
         return true;
     }
 
+    // Number of state verdicts cached; 0 turns the cache off. Clears the cache.
+    void setSafetyCacheCapacity(size_t entries)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        safetyCache.clear();
+        safetyCacheKeys.clear();
+        safetyCacheNext = 0;
+        safetyCacheCapacity = entries;
+    }
+
+    struct SafetyCacheStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    // Lookups made by requests that the envelopes and remembered verdicts could not settle
+    SafetyCacheStats safetyCacheStats()
+    {
+        shared_lock<shared_mutex> lock(mtx);
+        return {safetyCacheHits, safetyCacheMisses};
+    }
+
+    // Smallest process count at which the Parallel algorithm uses the thread pool
+    void setParallelThreshold(size_t processes)
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        parallelThreshold = processes;
+    }
+
+    // Starts publishing a Snapshot after every change. Call it before any thread uses readSnapshot.
+    void enableSnapshots()
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        if (epochs)
+            return;
+
+        epochs.reset(new EpochDomain());
+        dirtyLogBase = stateVersion;
+        publishSnapshot();
+    }
+
+    // Runs read(snapshot) on the latest published snapshot without taking mtx, so it
+    // never waits for admissions. The snapshot must not be kept once read returns.
+    template <typename Read>
+    auto readSnapshot(Read read) const
+    {
+        struct Pin
+        {
+            EpochDomain &epochs;
+            size_t slot;
+            ~Pin() { epochs.exit(slot); }
+        } pin{*epochs, epochs->enter()};
+
+        const Snapshot &snapshot = *published.load();
+        return read(snapshot);
+    }
+
+    bool isSafeState()
+    {
+        {
+            shared_lock<shared_mutex> lock(mtx);
+            if (componentsNotHolding == 0)
+                return true;
+        }
+
+        // Some component has no verdict yet; searching caches one, which needs mtx exclusively
+        unique_lock<shared_mutex> lock(mtx);
+        return firstUnsafeComponent(-1) < 0;
+    }
+
     void printAllocation()
     {
+        shared_lock<shared_mutex> lock(mtx);
         cout << "Allocation Matrix:\n";
-        for (const auto &row : allocation)
+        for (size_t i = 0; i < state.processes(); ++i)
         {
-            for (int value : row)
-                cout << value << " ";
+            for (size_t j = 0; j < state.resourceTypes(); ++j)
+                cout << state.allocationAt(i, j) << " ";
             cout << "\n";
         }
     }
 
     void printMax()
     {
+        shared_lock<shared_mutex> lock(mtx);
         cout << "Max Matrix:\n";
-        for (const auto &row : max)
+        for (size_t i = 0; i < state.processes(); ++i)
         {
-            for (int value : row)
-                cout << value << " ";
+            for (size_t j = 0; j < state.resourceTypes(); ++j)
+                cout << state.maxAt(i, j) << " ";
             cout << "\n";
         }
     }
 
     void printAvailable()
     {
+        shared_lock<shared_mutex> lock(mtx);
         cout << "Available Resources: ";
-        for (int value : available)
-            cout << value << " ";
+        for (size_t j = 0; j < state.resourceTypes(); ++j)
+            cout << available[j] << " ";
         cout << "\n";
     }
 
     void printResources()
     {
+        shared_lock<shared_mutex> lock(mtx);
         cout << "Total Resources: ";
-        for (int value : resources)
-            cout << value << " ";
+        for (size_t j = 0; j < state.resourceTypes(); ++j)
+            cout << resources[j] << " ";
         cout << "\n";
     }
 };
 
+// Any number of resource types, sized at run time
+using BankersAlgorithm = BasicBankersAlgorithm<DenseStorage<int>>;
+
+// Run-time sized, with T (for example uint16_t, uint32_t or int64_t) as the unit counter
+template <typename T>
+using CountedBankersAlgorithm = BasicBankersAlgorithm<DenseStorage<T>>;
+
+// Mostly empty claim matrices, stored and scanned as CSR rows of claimed resources
+template <typename T = int>
+using SparseBankersAlgorithm = BasicBankersAlgorithm<SparseStorage<T>>;
+
+// Exactly R resource types, with every row held inline and its loops unrolled
+template <size_t R, typename T = int>
+using FixedBankersAlgorithm = BasicBankersAlgorithm<FixedStorage<T, R>>;
+
 void runScenarios()
 {
     vector<vector<int>> allocation = {
@@ -276,7 +2992,7 @@ void runScenarios2()
         {6, 5, 4}};
 
     vector<int> available = {3, 3, 2};
-    BankersAlgorithm bankers(allocation, max, available);
+    FixedBankersAlgorithm<3> bankers(allocation, max, available);
 
     // Scenario 1: Successful resource request
     int processId = 1;